@@ -1,5 +1,6 @@
 #include <Wire.h>
 #include <LiquidCrystal_I2C.h>
+#include <esp_partition.h>
 LiquidCrystal_I2C lcd(0x27, 16, 2);   // Change address to 0x3F if needed
 
 const int PIN_NS_RED    = 2;
@@ -16,38 +17,350 @@ const int PIN_PED_GREEN = 23;
 const int PIN_BTN_NS_TRAFFIC  = 12;   
 const int PIN_BTN_EW_TRAFFIC  = 13;   
 const int PIN_BTN_PED_REQUEST = 14;   
+const int PIN_BTN_NS_ADVANCE  = 25;   // upstream (advance) detectors
+const int PIN_BTN_EW_ADVANCE  = 26;
 
-const int YELLOW_TIME_SEC   = 3;
-const int PED_TIME_SEC      = 8;
 const int BASE_GREEN_SEC    = 10;     
+const int MAX_GREEN_SEC     = 50;
+
+// Approach geometry for the change (yellow) and clearance (all-red) intervals
+const float NS_APPROACH_SPEED_KMH = 50.0;
+const float NS_APPROACH_GRADE_PCT = 0.0;    // + uphill, - downhill
+const float NS_CROSSING_WIDTH_M   = 14.0;   // stop line to far edge of conflicting lanes
+const float EW_APPROACH_SPEED_KMH = 40.0;
+const float EW_APPROACH_GRADE_PCT = 0.0;
+const float EW_CROSSING_WIDTH_M   = 18.0;
+
+// Pedestrian walk grows with presses since last service; each crosswalk's
+// clearance comes from its own length, and the exclusive phase clears the longest
+const int   PED_CROSSWALKS          = 2;
+const float PED_CROSSWALK_LENGTH_M[PED_CROSSWALKS] = {
+  12.0,    // across the EW roadway, curb to curb (NS_CROSSING_WIDTH_M less setbacks)
+  16.0     // across the NS roadway (EW_CROSSING_WIDTH_M less setbacks)
+};
+const float PED_WALK_SPEED_MPS      = 1.2;
+const int   PED_MIN_WALK_SEC        = 4;
+const int   PED_MAX_WALK_SEC        = 7;
+const float PED_WALK_SEC_PER_PRESS  = 0.5;    // per press beyond the first
+
+const float PERCEPTION_REACTION_SEC = 1.0;
+const float DECEL_RATE_MPS2         = 3.05;
+const float VEHICLE_LENGTH_M        = 6.1;
+const float GRAVITY_MPS2            = 9.81;
+
+const unsigned long MIN_YELLOW_MS  = 3000;
+const unsigned long MAX_YELLOW_MS  = 6000;
+const unsigned long MAX_ALL_RED_MS = 6000;
+
+// Platoon prediction from advance detectors
+const float NS_ADVANCE_DIST_M     = 120.0;   // advance detector to stop line
+const float EW_ADVANCE_DIST_M     = 100.0;
+const int   ARRIVAL_HORIZON_SEC   = 32;      // 1 s bins, must exceed the longest travel time
+const int   PLATOON_LOOKAHEAD_SEC = 3;
+const int   PLATOON_MIN_VEHICLES  = 2;
+
+// Event log on the data (spiffs) partition: 256-byte pages, erased 4 KB sectors
+const int  LOG_PAGE_BYTES        = 256;
+const int  LOG_SECTOR_BYTES      = 4096;
+const int  LOG_RECORDS_PER_PAGE  = 31;      // 8-byte header + 31 x 8-byte records
+const unsigned long LOG_FLUSH_INTERVAL_MS = 60000;
+const uint32_t LOG_SEQ_ERASED    = 0xFFFFFFFF;
+
+// Volume history: 15-minute bins for 7 days, 6 bits each, escaped to an overflow table
+const int COUNT_SERIES       = 2;       // NS, EW stop-bar detectors
+const int COUNT_BINS         = 672;
+const unsigned long COUNT_BIN_MS = 15UL * 60UL * 1000UL;
+const int COUNT_FIELD_BITS   = 6;
+const uint8_t COUNT_ESCAPE   = 63;      // field value meaning "see overflow table"
+const int COUNT_OVERFLOW_SLOTS = 128;
+const uint16_t COUNT_SLOT_FREE = 0xFFFF;
+
+// Log-linear histograms: 8 sub-buckets per power of two (<= 12.5% relative error)
+const int HIST_SUB_BITS = 3;
+const int HIST_BUCKETS  = (32 - HIST_SUB_BITS + 1) << HIST_SUB_BITS;
+
+// Travel time: advance and stop-bar detectors matched in order (FIFO)
+const int   PAIR_FIFO_SLOTS      = 32;
+const float PAIR_MIN_TT_FRACTION = 0.5;     // faster than this: not seen upstream
+const unsigned long PAIR_MAX_EXTRA_MS = 120000;   // slower than free flow + this: missed at stop bar
+
+// Presence: occupancy and hold time on the stop-bar detectors
+const unsigned long OCC_INTERVAL_MS   = 60000;   // reported occupancy period
+const float OCC_SHORT_TAU_MS          = 3000.0;  // smoothing for the green logic
+const float OCC_QUEUE_FRACTION        = 0.6;     // above this the queue is still discharging
+const unsigned long PRESENCE_STOPPED_MS = 3000;  // longer holds are stopped vehicles
+const float DETECTOR_LENGTH_M         = 2.0;
+const float LENGTH_CLASS_MEDIUM_M     = 7.5;
+const float LENGTH_CLASS_LONG_M       = 12.5;
+
+// Queue discharge: green = start-up lost time + queue x saturation headway
+const float SAT_HEADWAY_INIT_SEC = 2.0;
+const float LOST_TIME_INIT_SEC   = 2.0;
+const float SAT_HEADWAY_MIN_SEC  = 1.2;
+const float SAT_HEADWAY_MAX_SEC  = 4.0;
+const float LOST_TIME_MAX_SEC    = 6.0;
+const float DISCHARGE_ALPHA      = 0.1;
+const int   LOST_TIME_VEHICLES   = 4;     // headways from the 5th queued vehicle on are saturated
+const unsigned long DISCHARGE_MAX_HEADWAY_MS = 4000;   // larger gap: queue has cleared
+
+// Split failure: a real queue at green start, no gap before green end (a recent
+// actuation or a stop-bar detector still mostly occupied), and vehicles still
+// arriving right after it
+const int   SF_MIN_QUEUE     = 3;
+const unsigned long SF_END_GAP_MS = 2000;
+const float SF_RATE_ALPHA    = 0.25;    // EWMA weight of the latest green
+const int   SF_MAX_BIAS_SEC  = 10;      // extra green at a 100% failure rate
+
+// Online tuning of the queue estimate (scales counted calls per approach)
+const unsigned long RESIDUAL_WINDOW_MS = 5000;   // calls this soon after green may be left behind
+const unsigned long WASTED_GAP_MS      = 4000;   // no call for this long before green end
+const float QUEUE_GAIN_STEP  = 0.05;
+const float QUEUE_GAIN_DECAY = 0.005;   // per green that left no queue behind
+const float QUEUE_GAIN_MIN  = 0.5;
+const float QUEUE_GAIN_MAX  = 3.0;
+
+// Low-demand flash: flashing yellow NS (main), flashing red EW (side)
+const int FLASH_ENTRY_CYCLES    = 4;    // consecutive quiet cycles before flashing
+const int FLASH_MAX_MAIN_CALLS  = 2;
+const int FLASH_MAX_SIDE_CALLS  = 0;
+const int FLASH_FREQ_HZ         = 1;
+const int FLASH_LEDC_RES_BITS   = 17;   // 1 Hz still fits the LEDC divider from APB
+const int FLASH_LEDC_CH_MAIN    = 0;    // channels 0/1 share a timer, so both flash in phase
+const int FLASH_LEDC_CH_SIDE    = 1;
 
 enum Phase {
   PHASE_NS_GREEN,
   PHASE_NS_YELLOW,
+  PHASE_NS_ALL_RED,
   PHASE_EW_GREEN,
   PHASE_EW_YELLOW,
-  PHASE_PED_GREEN
+  PHASE_EW_ALL_RED,
+  PHASE_PED_GREEN,
+  PHASE_FLASH
 };
 
 Phase currentPhase = PHASE_NS_GREEN;
 
+enum LogEventType {
+  LOG_BOOT,
+  LOG_PHASE,        // arg = Phase
+  LOG_DETECTOR      // arg = Detector, value = Phase at the time
+};
+
+enum Detector {
+  DET_NS_STOP,
+  DET_EW_STOP,
+  DET_PED,
+  DET_NS_ADVANCE,
+  DET_EW_ADVANCE
+};
+
+struct LogRecord {
+  uint32_t timeMs;     // millis() since the preceding LOG_BOOT
+  uint8_t  type;
+  uint8_t  arg;
+  uint16_t value;
+};
+
+struct LogPage {
+  uint32_t  seq;       // LOG_SEQ_ERASED when the page is blank
+  uint16_t  count;
+  uint16_t  crc;       // CRC-16/CCITT over seq, count and the used records
+  LogRecord records[LOG_RECORDS_PER_PAGE];
+};
+
+const esp_partition_t* logPartition = NULL;
+uint32_t logPageCount     = 0;
+uint32_t logHeadPage      = 0;     // next page to program
+uint32_t logNextSeq       = 0;
+LogPage  logBuffer;
+unsigned long logLastFlushMs = 0;
+
+uint32_t logRecordsWritten = 0;    // since boot, for write amplification
+uint32_t logPagesWritten   = 0;
+uint32_t logSectorsErased  = 0;
+
+struct CountOverflow {
+  uint16_t bin;        // series * COUNT_BINS + slot, COUNT_SLOT_FREE if unused
+  uint16_t count;
+};
+
+uint8_t       countPacked[(COUNT_SERIES * COUNT_BINS * COUNT_FIELD_BITS + 7) / 8];
+CountOverflow countOverflow[COUNT_OVERFLOW_SLOTS];
+unsigned long countCurrentBin = 0;     // 15-minute bins elapsed since boot
+unsigned long countBinStartMs = 0;     // millis() at the start of the current bin
+uint32_t      countSaturated  = 0;     // increments lost because the table was full
+
+struct Histogram {
+  uint32_t buckets[HIST_BUCKETS];
+  uint32_t count;
+  uint32_t maxValue;
+};
+
+// Input edges are sampled by polling, so an edge is timed from the previous
+// sample: every latency below is the worst case for that edge.
+Histogram latInputToCount;      // us, stop-bar edge -> traffic count updated
+Histogram latInputToDisplay;    // us, any detector edge -> LCD written
+Histogram latPedCallToWalk;     // us, first ped press -> PIN_PED_GREEN on
+Histogram latVehCallToGreen;    // us, first counted call on red -> own green
+
+// Service-quality distributions, kept per approach and merged for the junction
+Histogram nsDelayHist;          // ms, control delay of matched vehicles
+Histogram ewDelayHist;
+Histogram nsQueueHist;          // vehicles counted at green start
+Histogram ewQueueHist;
+Histogram pedWaitHist;          // ms, first press -> walk
+unsigned long lastPollUs = 0;
+unsigned long pedCallUs  = 0;
+unsigned long nsCallUs   = 0;
+unsigned long ewCallUs   = 0;
+
+uint64_t ctlIdleUs = 0;          // time spent sleeping in the poll tick
+uint64_t ctlWallUs = 0;          // time between poll ticks, summed tick by tick
+unsigned long ctlLastTickUs = 0;  // seeded at the end of setup()
+
+struct RunningStats {
+  uint32_t n;
+  float    mean;
+  float    m2;          // sum of squared deviations (Welford)
+  float    maxValue;
+};
+
+struct PairFifo {
+  unsigned long advanceMs[PAIR_FIFO_SLOTS];
+  uint8_t  head;
+  uint8_t  count;
+  uint32_t overflows;   // advance entries dropped unmatched
+  uint32_t underflows;  // stop-bar events with no upstream partner
+};
+
+enum LengthClass {
+  LENGTH_SHORT,
+  LENGTH_MEDIUM,
+  LENGTH_LONG,
+  LENGTH_STOPPED,
+  LENGTH_CLASSES
+};
+
+struct Presence {
+  bool          occupied;
+  unsigned long lastSampleMs;
+  unsigned long holdStartMs;
+  unsigned long intervalStartMs;
+  unsigned long intervalOccupiedMs;
+  float         intervalOccPct;      // last completed OCC_INTERVAL_MS
+  float         shortOcc;            // 0..1, exponentially smoothed
+  uint32_t      lengthClass[LENGTH_CLASSES];
+};
+
+Presence nsPresence;
+Presence ewPresence;
+
+struct DischargeModel {
+  float         satHeadwaySec;
+  float         lostTimeSec;
+  int           queueAtGreen;
+  int           departures;        // this green
+  unsigned long greenStartMs;
+  unsigned long lastDepartureMs;
+  uint32_t      headwaySamples;
+};
+
+DischargeModel nsDischarge = { SAT_HEADWAY_INIT_SEC, LOST_TIME_INIT_SEC, 0, 0, 0, 0, 0 };
+DischargeModel ewDischarge = { SAT_HEADWAY_INIT_SEC, LOST_TIME_INIT_SEC, 0, 0, 0, 0, 0 };
+
+PairFifo     nsPairs;
+PairFifo     ewPairs;
+RunningStats nsTravelSec;
+RunningStats ewTravelSec;
+RunningStats nsDelaySec;
+RunningStats ewDelaySec;
+
+bool     logDumpActive   = false;
+uint32_t logDumpPagesLeft = 0;
+uint32_t logDumpPageIdx  = 0;
+int      logDumpRecIdx   = 0;
+LogPage  logDumpPage;
+
+unsigned long nsYellowMs = MIN_YELLOW_MS;
+unsigned long nsAllRedMs = 0;
+unsigned long ewYellowMs = MIN_YELLOW_MS;
+unsigned long ewAllRedMs = 0;
+
 int trafficCountNS = 0;   
 int trafficCountEW = 0;   
 
 bool pedRequest = false;  
+int  pedPressCount = 0;
+int  pedClearanceSec = 0;
+bool pedClearing = false;          // walk over, DONT WALK flashing
+int  pedNextPressCount = 0;        // presses too late for this walk
+unsigned long pedNextCallUs = 0;
+
+float nsQueueGain = 1.0;
+float ewQueueGain = 1.0;
+unsigned long nsGreenStartMs    = 0;
+unsigned long ewGreenStartMs    = 0;
+unsigned long nsGreenEndMs      = 0;
+unsigned long ewGreenEndMs      = 0;
+unsigned long nsLastGreenCallMs = 0;
+unsigned long ewLastGreenCallMs = 0;
+unsigned long nsWastedGreenMs   = 0;
+unsigned long ewWastedGreenMs   = 0;
+int  nsResidualCalls = 0;
+int  ewResidualCalls = 0;
+bool nsWasExtended   = false;
+bool ewWasExtended   = false;
+float nsOccAtGreenEnd = 0.0;       // stop-bar short-term occupancy as green ended
+float ewOccAtGreenEnd = 0.0;
+
+float nsSplitFailRate = 0.0;
+float ewSplitFailRate = 0.0;
+int   nsConsecutiveSplitFails = 0;
+int   ewConsecutiveSplitFails = 0;
+unsigned long nsSplitFails = 0;
+unsigned long ewSplitFails = 0;
+
+int  nsCallsAtGreen     = 0;
+int  ewCallsAtGreen     = 0;
+bool pedServedThisCycle = false;
+int  lowDemandCycles    = 0;
 
 bool lastNsBtnState  = HIGH;
 bool lastEwBtnState  = HIGH;
 bool lastPedBtnState = HIGH;
+bool lastNsAdvBtnState = HIGH;
+bool lastEwAdvBtnState = HIGH;
+
+unsigned long nsAdvanceTravelMs = 0;
+unsigned long ewAdvanceTravelMs = 0;
+unsigned long nsReleaseTravelMs = 0;   // free flow, advance actuation -> stop-bar release
+unsigned long ewReleaseTravelMs = 0;
+uint8_t       nsArrivalBins[ARRIVAL_HORIZON_SEC];
+uint8_t       ewArrivalBins[ARRIVAL_HORIZON_SEC];
+unsigned long nsArrivalBinSec[ARRIVAL_HORIZON_SEC];
+unsigned long ewArrivalBinSec[ARRIVAL_HORIZON_SEC];
+
+unsigned long nsArrivals        = 0;   // stop-bar detections, for arrivals-on-green
+unsigned long ewArrivals        = 0;
+unsigned long nsArrivalsOnGreen = 0;
+unsigned long ewArrivalsOnGreen = 0;
 
 void readButtons();
 void waitOneSecondWithButtons();
+void waitMillisWithButtons(unsigned long ms);
 
 void phaseNsGreen();
 void phaseNsYellow();
+void phaseNsAllRed();
 void phaseEwGreen();
 void phaseEwYellow();
+void phaseEwAllRed();
 void phasePedestrianIfRequested();
+int  computePedWalkSeconds();
+unsigned long pedPhaseMs();
+void runFlashMode();
+void updateLowDemandState();
 
 void setAllVehicleRed();
 void setNsGreenState();
@@ -55,16 +368,94 @@ void setNsYellowState();
 void setEwGreenState();
 void setEwYellowState();
 void setPedestrianGreenState();
+void setFlashState();
+void clearFlashState();
+void startLedcFlash(int pin, int channel);
+void stopLedcFlash(int pin);
 
 bool isNsRed();
 bool isEwRed();
 
 int  computeNsGreenSeconds();
 int  computeEwGreenSeconds();
+int  queueClearanceSeconds(const DischargeModel& m, float queue);
+void dischargeStartGreen(DischargeModel& m, int queue, unsigned long nowMs);
+void dischargeDeparture(DischargeModel& m, unsigned long nowMs);
+void dischargePrintReport();
+void tuneQueueGain(float &gain, float leftBehind, unsigned long wastedMs, bool wasExtended,
+                   bool splitFailBiased);
+float residualExcess(int series, int residualCalls, float occAtGreenEnd);
+float recentFlowPerSec(int series);
+bool updateSplitFailure(float &rate, int &consecutive, int queueAtGreen,
+                        int residualCalls, unsigned long endGapMs, float occAtEnd);
+int  splitFailureBiasSeconds(float rate);
+void splitFailurePrintReport();
+
+void computeClearanceIntervals();
+unsigned long yellowIntervalMs(float speedKmh, float gradePct);
+unsigned long allRedIntervalMs(float speedKmh, float crossingWidthM);
+
+void computeAdvanceTravelTimes();
+void recordPredictedArrival(uint8_t bins[], unsigned long binSec[], unsigned long arrivalSec);
+int  predictedArrivals(const uint8_t bins[], const unsigned long binSec[],
+                       unsigned long fromSec, int spanSec);
+bool nsPlatoonArriving(unsigned long delayMs);
+bool ewPlatoonArriving(unsigned long delayMs);
+void arrivalsOnGreenPrintReport();
 
 void lcdShowTwoLines(const char* line1, const char* line2);
 
+void enterPhase(Phase phase);
+
+void logInit();
+void logEvent(uint8_t type, uint8_t arg, uint16_t value);
+void logFlush();
+void logFlushIfDue();
+uint16_t logPageCrc(const LogPage& page);
+uint16_t crc16Update(uint16_t crc, const uint8_t* data, size_t len);
+void logStartDump();
+void logServiceDump();
+void logPrintRecord(uint32_t seq, const LogRecord& rec);
+void logPrintStats();
+void pollSerialCommands();
+
+void histRecord(Histogram& h, uint32_t value);
+void histReset(Histogram& h);
+int  histBucket(uint32_t value);
+uint32_t histBucketUpper(int bucket);
+uint32_t histPercentile(const Histogram& h, float q);
+void histMerge(Histogram& into, const Histogram& from);
+void histPrint(const char* name, const Histogram& h);
+void metricsPrintReport();
+void latPrintReport();
+
+void presenceSample(Presence& p, bool occupied, unsigned long nowMs, float speedKmh);
+void presenceClassify(Presence& p, unsigned long holdMs, float speedKmh);
+bool queueDischarging(const Presence& p);
+void presencePrintReport();
+void pairPushAdvance(PairFifo& fifo, unsigned long nowMs);
+void pairMatchStopBar(PairFifo& fifo, unsigned long nowMs, unsigned long freeFlowMs,
+                      RunningStats& travel, RunningStats& delaySec, Histogram& delayHist);
+void statsAdd(RunningStats& st, float x);
+void statsPrint(const char* name, const RunningStats& st);
+void travelPrintReport();
+
+size_t controllerStateBytes();
+void costPrintReport();
+
+void countInit();
+void countRecord(int series);
+void countAdvanceBins();
+uint8_t countGetField(int idx);
+void countSetField(int idx, uint8_t value);
+int  countFindOverflow(int idx);
+uint16_t countBinValue(int series, int slot);
+void countPrintBlock();
+
 void setup() {
+  Serial.setTxBufferSize(4096);   // history block goes out without blocking
+  Serial.begin(115200);
+
   // Use GPIO32 as SDA and GPIO33 as SCL for I2C
   Wire.begin(32, 33);
 
@@ -87,6 +478,14 @@ void setup() {
   pinMode(PIN_BTN_NS_TRAFFIC, INPUT_PULLUP);
   pinMode(PIN_BTN_EW_TRAFFIC, INPUT_PULLUP);
   pinMode(PIN_BTN_PED_REQUEST, INPUT_PULLUP);
+  pinMode(PIN_BTN_NS_ADVANCE, INPUT_PULLUP);
+  pinMode(PIN_BTN_EW_ADVANCE, INPUT_PULLUP);
+
+  computeClearanceIntervals();
+  computeAdvanceTravelTimes();
+  logInit();
+  logEvent(LOG_BOOT, 0, 0);
+  countInit();
 
   setAllVehicleRed();
   digitalWrite(PIN_PED_RED, HIGH);
@@ -94,6 +493,8 @@ void setup() {
 
   lcdShowTwoLines("Traffic System", "Ready");
   delay(1000);
+
+  ctlLastTickUs = micros();   // setup()'s delays are not controller work
 }
 
 void setAllVehicleRed() {
@@ -108,20 +509,53 @@ void setAllVehicleRed() {
 
 void loop() {
 
-  phaseNsGreen();
-  phaseNsYellow();
+  if (lowDemandCycles >= FLASH_ENTRY_CYCLES) {
+    runFlashMode();               // returns on side-street or pedestrian demand
+    phaseNsYellow();              // flashing yellow -> steady yellow -> red
+  } else {
+    phaseNsGreen();
+    phaseNsYellow();
+  }
+  phaseNsAllRed();
   phasePedestrianIfRequested();   
 
   phaseEwGreen();
   phaseEwYellow();
+  phaseEwAllRed();
   phasePedestrianIfRequested();   
+
+  updateLowDemandState();
+}
+
+void updateLowDemandState() {
+  bool quiet = (nsCallsAtGreen <= FLASH_MAX_MAIN_CALLS &&
+                ewCallsAtGreen <= FLASH_MAX_SIDE_CALLS &&
+                !pedServedThisCycle);
+  lowDemandCycles = quiet ? lowDemandCycles + 1 : 0;
+  pedServedThisCycle = false;
 }
 
 void readButtons() {
+  unsigned long edgeUs = lastPollUs;
+  lastPollUs = micros();
+
   bool nsBtn = digitalRead(PIN_BTN_NS_TRAFFIC);
+  presenceSample(nsPresence, nsBtn == LOW, millis(), NS_APPROACH_SPEED_KMH);
   if (nsBtn == LOW && lastNsBtnState == HIGH) {      
+    logEvent(LOG_DETECTOR, DET_NS_STOP, currentPhase);
+    countRecord(0);
+    nsArrivals++;
+    if (currentPhase == PHASE_NS_GREEN) {
+      nsArrivalsOnGreen++;
+      nsLastGreenCallMs = millis();
+    } else if (millis() - nsGreenEndMs < RESIDUAL_WINDOW_MS) {
+      nsResidualCalls++;
+    }
+
     if (isNsRed()) {                                 
       trafficCountNS++;                              
+      histRecord(latInputToCount, micros() - edgeUs);
+      if (trafficCountNS == 1) nsCallUs = edgeUs;
 
       lcd.clear();
       lcd.setCursor(0, 0);
@@ -132,14 +566,34 @@ void readButtons() {
     } else {
       lcdShowTwoLines("NS not RED", "No count");
     }
+    histRecord(latInputToDisplay, micros() - edgeUs);
     delay(30);   
   }
+  if (nsBtn == HIGH && lastNsBtnState == LOW) {
+    // Release, not actuation, is the departure: a red arrival sits on the loop
+    pairMatchStopBar(nsPairs, millis(), nsReleaseTravelMs, nsTravelSec, nsDelaySec,
+                     nsDelayHist);
+    if (currentPhase == PHASE_NS_GREEN) dischargeDeparture(nsDischarge, millis());
+  }
   lastNsBtnState = nsBtn;
 
   bool ewBtn = digitalRead(PIN_BTN_EW_TRAFFIC);
+  presenceSample(ewPresence, ewBtn == LOW, millis(), EW_APPROACH_SPEED_KMH);
   if (ewBtn == LOW && lastEwBtnState == HIGH) {      
+    logEvent(LOG_DETECTOR, DET_EW_STOP, currentPhase);
+    countRecord(1);
+    ewArrivals++;
+    if (currentPhase == PHASE_EW_GREEN) {
+      ewArrivalsOnGreen++;
+      ewLastGreenCallMs = millis();
+    } else if (millis() - ewGreenEndMs < RESIDUAL_WINDOW_MS) {
+      ewResidualCalls++;
+    }
+
     if (isEwRed()) {                                 
       trafficCountEW++;                              
+      histRecord(latInputToCount, micros() - edgeUs);
+      if (trafficCountEW == 1) ewCallUs = edgeUs;
 
       lcd.clear();
       lcd.setCursor(0, 0);
@@ -150,42 +604,102 @@ void readButtons() {
     } else {
       lcdShowTwoLines("EW not RED", "No count");
     }
+    histRecord(latInputToDisplay, micros() - edgeUs);
     delay(30);   
   }
+  if (ewBtn == HIGH && lastEwBtnState == LOW) {
+    // Release, not actuation, is the departure: a red arrival sits on the loop
+    pairMatchStopBar(ewPairs, millis(), ewReleaseTravelMs, ewTravelSec, ewDelaySec,
+                     ewDelayHist);
+    if (currentPhase == PHASE_EW_GREEN) dischargeDeparture(ewDischarge, millis());
+  }
   lastEwBtnState = ewBtn;
 
   bool pedBtn = digitalRead(PIN_BTN_PED_REQUEST);
   if (pedBtn == LOW && lastPedBtnState == HIGH) {    
-    pedRequest = true;                               
+    if (pedClearing) {
+      // Too late to cross on this walk: carry the call into the next one
+      if (pedNextPressCount == 0) pedNextCallUs = edgeUs;
+      pedNextPressCount++;
+    } else {
+      if (!pedRequest) pedCallUs = edgeUs;
+      pedRequest = true;                               
+      pedPressCount++;
+    }
+    logEvent(LOG_DETECTOR, DET_PED, currentPhase);
     lcdShowTwoLines("Pedestrian Request", "Recieved");
+    histRecord(latInputToDisplay, micros() - edgeUs);
     delay(30);
   }
   lastPedBtnState = pedBtn;
+
+  bool nsAdvBtn = digitalRead(PIN_BTN_NS_ADVANCE);
+  if (nsAdvBtn == LOW && lastNsAdvBtnState == HIGH) {
+    logEvent(LOG_DETECTOR, DET_NS_ADVANCE, currentPhase);
+    pairPushAdvance(nsPairs, millis());
+    recordPredictedArrival(nsArrivalBins, nsArrivalBinSec,
+                           (millis() + nsAdvanceTravelMs) / 1000);
+    delay(30);
+  }
+  lastNsAdvBtnState = nsAdvBtn;
+
+  bool ewAdvBtn = digitalRead(PIN_BTN_EW_ADVANCE);
+  if (ewAdvBtn == LOW && lastEwAdvBtnState == HIGH) {
+    logEvent(LOG_DETECTOR, DET_EW_ADVANCE, currentPhase);
+    pairPushAdvance(ewPairs, millis());
+    recordPredictedArrival(ewArrivalBins, ewArrivalBinSec,
+                           (millis() + ewAdvanceTravelMs) / 1000);
+    delay(30);
+  }
+  lastEwAdvBtnState = ewAdvBtn;
 }
 bool isNsRed() {
   return (currentPhase == PHASE_EW_GREEN ||
           currentPhase == PHASE_EW_YELLOW ||
+          currentPhase == PHASE_NS_ALL_RED ||
+          currentPhase == PHASE_EW_ALL_RED ||
           currentPhase == PHASE_PED_GREEN);
 }
 
 bool isEwRed() {
   return (currentPhase == PHASE_NS_GREEN ||
           currentPhase == PHASE_NS_YELLOW ||
-          currentPhase == PHASE_PED_GREEN);
+          currentPhase == PHASE_NS_ALL_RED ||
+          currentPhase == PHASE_EW_ALL_RED ||
+          currentPhase == PHASE_PED_GREEN ||
+          currentPhase == PHASE_FLASH);
 }
 
 
 
 
 void phaseNsGreen() {
-  currentPhase = PHASE_NS_GREEN;
+  enterPhase(PHASE_NS_GREEN);
+  if (updateSplitFailure(nsSplitFailRate, nsConsecutiveSplitFails, nsCallsAtGreen,
+                         nsResidualCalls, nsWastedGreenMs, nsOccAtGreenEnd)) {
+    nsSplitFails++;
+  }
+  nsCallsAtGreen = trafficCountNS;
+  tuneQueueGain(nsQueueGain, residualExcess(0, nsResidualCalls, nsOccAtGreenEnd),
+                nsWastedGreenMs, nsWasExtended, splitFailureBiasSeconds(nsSplitFailRate) > 0);
   int totalSecs = computeNsGreenSeconds();
   int baseSecs  = BASE_GREEN_SEC;
   int extraSecs = totalSecs - baseSecs;
   if (extraSecs < 0) extraSecs = 0;
 
   setNsGreenState();
+  if (nsCallsAtGreen > 0) histRecord(latVehCallToGreen, micros() - nsCallUs);
+  nsGreenStartMs = millis();
+  dischargeStartGreen(nsDischarge, nsCallsAtGreen, nsGreenStartMs);
+  histRecord(nsQueueHist, nsCallsAtGreen);
+  nsLastGreenCallMs = nsGreenStartMs;
   for (int remaining = totalSecs; remaining > 0; remaining--) {
+    // Past the base green, yield early so a cross-street platoon meets green
+    if (remaining <= extraSecs && !nsPlatoonArriving(0) &&
+        ewPlatoonArriving(nsYellowMs + nsAllRedMs + pedPhaseMs())) {
+      break;
+    }
+
     lcd.clear();
     lcd.setCursor(0, 0);
     lcd.print("NS Green ");
@@ -201,21 +715,114 @@ void phaseNsGreen() {
 
     waitOneSecondWithButtons();  
   }
+  for (int held = totalSecs; held < MAX_GREEN_SEC &&
+       (nsPlatoonArriving(0) || queueDischarging(nsPresence)); held++) {
+    lcdShowTwoLines("NS Green", nsPlatoonArriving(0) ? "Platoon hold" : "Queue hold");
+    waitOneSecondWithButtons();
+  }
   trafficCountNS = 0;
+
+  nsGreenEndMs      = millis();
+  nsWastedGreenMs   = nsGreenEndMs - nsLastGreenCallMs;
+  nsWasExtended     = (extraSecs > 0);
+  nsOccAtGreenEnd   = nsPresence.shortOcc;
+  nsResidualCalls   = 0;
 }
 
 int computeNsGreenSeconds() {
-  int extra = 0;
-  if (trafficCountNS >= 15) {
-    extra = 30;
-  } else if (trafficCountNS >= 10) {
-    extra = 20;
-  } else if (trafficCountNS >= 5) {
-    extra = 10;
-  } else {
-    extra = 0;
+  int secs = queueClearanceSeconds(nsDischarge, trafficCountNS * nsQueueGain) +
+             splitFailureBiasSeconds(nsSplitFailRate);
+  return constrain(secs, BASE_GREEN_SEC, MAX_GREEN_SEC);
+}
+
+int queueClearanceSeconds(const DischargeModel& m, float queue) {
+  return (int)ceil(m.lostTimeSec + queue * m.satHeadwaySec);
+}
+
+void dischargeStartGreen(DischargeModel& m, int queue, unsigned long nowMs) {
+  m.queueAtGreen = queue;
+  m.departures = 0;
+  m.greenStartMs = nowMs;
+  m.lastDepartureMs = nowMs;
+}
+
+// Departures are stop-bar releases during green, so the vehicle standing on
+// the loop at green start is departure 1. Only departures from the queue
+// standing at green start are used, and a long gap ends the discharge
+void dischargeDeparture(DischargeModel& m, unsigned long nowMs) {
+  unsigned long headwayMs = nowMs - m.lastDepartureMs;
+  m.lastDepartureMs = nowMs;
+  m.departures++;
+  if (m.departures > m.queueAtGreen) return;
+  if (m.departures > 1 && headwayMs > DISCHARGE_MAX_HEADWAY_MS) {
+    m.queueAtGreen = 0;
+    return;
+  }
+
+  if (m.departures > LOST_TIME_VEHICLES) {
+    m.satHeadwaySec += DISCHARGE_ALPHA * (headwayMs / 1000.0 - m.satHeadwaySec);
+    m.satHeadwaySec = constrain(m.satHeadwaySec, SAT_HEADWAY_MIN_SEC, SAT_HEADWAY_MAX_SEC);
+    m.headwaySamples++;
+  } else if (m.departures == LOST_TIME_VEHICLES) {
+    float lost = (nowMs - m.greenStartMs) / 1000.0 - LOST_TIME_VEHICLES * m.satHeadwaySec;
+    m.lostTimeSec += DISCHARGE_ALPHA * (lost - m.lostTimeSec);
+    m.lostTimeSec = constrain(m.lostTimeSec, 0.0f, LOST_TIME_MAX_SEC);
+  }
+}
+
+void dischargePrintReport() {
+  Serial.print("NS headway=");
+  Serial.print(nsDischarge.satHeadwaySec, 2);
+  Serial.print("s lost=");
+  Serial.print(nsDischarge.lostTimeSec, 2);
+  Serial.print("s samples=");
+  Serial.println(nsDischarge.headwaySamples);
+  Serial.print("EW headway=");
+  Serial.print(ewDischarge.satHeadwaySec, 2);
+  Serial.print("s lost=");
+  Serial.print(ewDischarge.lostTimeSec, 2);
+  Serial.print("s samples=");
+  Serial.println(ewDischarge.headwaySamples);
+}
+
+// Vehicles left at green end mean the curve was too short; a long call-free
+// tail on an extended green means it was too generous. The left-behind
+// estimate has zero mean when nothing is left, so random arrivals no longer
+// ratchet the gain up, and a green with no residual calls lets it drift down.
+// While the split-failure bias is adding green it stands in for the tuner, so
+// the same left-behind vehicles are not corrected twice.
+void tuneQueueGain(float &gain, float leftBehind, unsigned long wastedMs, bool wasExtended,
+                   bool splitFailBiased) {
+  if (splitFailBiased) return;
+  gain += QUEUE_GAIN_STEP * leftBehind;
+  if (wasExtended && wastedMs >= WASTED_GAP_MS) {
+    gain -= QUEUE_GAIN_STEP;
+  } else if (leftBehind <= 0) {
+    gain -= QUEUE_GAIN_DECAY;
   }
-  return BASE_GREEN_SEC + extra;
+  gain = constrain(gain, QUEUE_GAIN_MIN, QUEUE_GAIN_MAX);
+}
+
+// The residual window is mostly the approach's own yellow and all-red, so
+// random arrivals land in it: only calls beyond what the recent flow predicts
+// were left behind. A loop still held at green end is at least one vehicle.
+float residualExcess(int series, int residualCalls, float occAtGreenEnd) {
+  float expected = recentFlowPerSec(series) * RESIDUAL_WINDOW_MS / 1000.0;
+  float excess = residualCalls - expected;
+  if (occAtGreenEnd >= OCC_QUEUE_FRACTION && excess < 1.0) excess = 1.0;
+  return excess;
+}
+
+// Stop-bar flow over the current and the previous 15-minute bin
+float recentFlowPerSec(int series) {
+  countAdvanceBins();
+  unsigned long spanMs = millis() - countBinStartMs;
+  uint32_t n = countBinValue(series, countCurrentBin % COUNT_BINS);
+  if (countCurrentBin > 0) {
+    n += countBinValue(series, (countCurrentBin - 1) % COUNT_BINS);
+    spanMs += COUNT_BIN_MS;
+  }
+  return spanMs > 0 ? n * 1000.0 / spanMs : 0.0;
 }
 
 void setNsGreenState() {
@@ -225,39 +832,72 @@ void setNsGreenState() {
 }
 
 void waitOneSecondWithButtons() {
-  for (int i = 0; i < 50; i++) {
+  waitMillisWithButtons(1000);
+}
+
+void waitMillisWithButtons(unsigned long ms) {
+  for (unsigned long waited = 0; waited < ms; waited += 20) {
     readButtons();
+    pollSerialCommands();
+    logFlushIfDue();
+    countAdvanceBins();
+
+    unsigned long sleepStartUs = micros();
     delay(20);
+    unsigned long tickEndUs = micros();
+    ctlIdleUs += tickEndUs - sleepStartUs;
+    ctlWallUs += tickEndUs - ctlLastTickUs;   // wrap-safe while ticks are < 71 min apart
+    ctlLastTickUs = tickEndUs;
   }
 }
 
 void phaseNsYellow() {
-  currentPhase = PHASE_NS_YELLOW;
-  for (int remaining = YELLOW_TIME_SEC; remaining > 0; remaining--) {
+  setNsYellowState();             // before any LCD or log work
+  enterPhase(PHASE_NS_YELLOW);
+  unsigned long remainingMs = nsYellowMs;
+  while (remainingMs > 0) {
+    unsigned long stepMs = remainingMs % 1000;   // fractional second first
+    if (stepMs == 0) stepMs = 1000;
+
     lcd.clear();
     lcd.setCursor(0, 0);
     lcd.print("NS Yellow T=");
-    lcd.print(remaining);
+    lcd.print((remainingMs + 999) / 1000);
     lcd.print("s");
 
     lcd.setCursor(0, 1);
     lcd.print("EW=");
     lcd.print(trafficCountEW);
 
-    setNsYellowState();
-    waitOneSecondWithButtons();
+    waitMillisWithButtons(stepMs);
+    remainingMs -= stepMs;
   }
 }
 
-void setNsYellowState() {
+void phaseNsAllRed() {
+  enterPhase(PHASE_NS_ALL_RED);
   setAllVehicleRed();
-  digitalWrite(PIN_NS_RED, LOW);
+  lcdShowTwoLines("NS All Red", "Clearance");
+  waitMillisWithButtons(nsAllRedMs);
+}
+
+// Yellow only ever follows green or flashing yellow, so never pass through red
+void setNsYellowState() {
   digitalWrite(PIN_NS_YELLOW, HIGH);
+  digitalWrite(PIN_NS_GREEN, LOW);
+  digitalWrite(PIN_NS_RED, LOW);
 }
 
 
 void phaseEwGreen() {
-  currentPhase = PHASE_EW_GREEN;
+  enterPhase(PHASE_EW_GREEN);
+  if (updateSplitFailure(ewSplitFailRate, ewConsecutiveSplitFails, ewCallsAtGreen,
+                         ewResidualCalls, ewWastedGreenMs, ewOccAtGreenEnd)) {
+    ewSplitFails++;
+  }
+  ewCallsAtGreen = trafficCountEW;
+  tuneQueueGain(ewQueueGain, residualExcess(1, ewResidualCalls, ewOccAtGreenEnd),
+                ewWastedGreenMs, ewWasExtended, splitFailureBiasSeconds(ewSplitFailRate) > 0);
 
   int totalSecs = computeEwGreenSeconds();
   int baseSecs  = BASE_GREEN_SEC;
@@ -265,7 +905,18 @@ void phaseEwGreen() {
   if (extraSecs < 0) extraSecs = 0;
 
   setEwGreenState();
+  if (ewCallsAtGreen > 0) histRecord(latVehCallToGreen, micros() - ewCallUs);
+  ewGreenStartMs = millis();
+  dischargeStartGreen(ewDischarge, ewCallsAtGreen, ewGreenStartMs);
+  histRecord(ewQueueHist, ewCallsAtGreen);
+  ewLastGreenCallMs = ewGreenStartMs;
   for (int remaining = totalSecs; remaining > 0; remaining--) {
+    // Past the base green, yield early so a cross-street platoon meets green
+    if (remaining <= extraSecs && !ewPlatoonArriving(0) &&
+        nsPlatoonArriving(ewYellowMs + ewAllRedMs + pedPhaseMs())) {
+      break;
+    }
+
     lcd.clear();
     lcd.setCursor(0, 0);
     
@@ -282,22 +933,279 @@ void phaseEwGreen() {
 
     waitOneSecondWithButtons();
   }
+  for (int held = totalSecs; held < MAX_GREEN_SEC &&
+       (ewPlatoonArriving(0) || queueDischarging(ewPresence)); held++) {
+    lcdShowTwoLines("EW Green", ewPlatoonArriving(0) ? "Platoon hold" : "Queue hold");
+    waitOneSecondWithButtons();
+  }
 
   trafficCountEW = 0;
+
+  ewGreenEndMs      = millis();
+  ewWastedGreenMs   = ewGreenEndMs - ewLastGreenCallMs;
+  ewWasExtended     = (extraSecs > 0);
+  ewOccAtGreenEnd   = ewPresence.shortOcc;
+  ewResidualCalls   = 0;
 }
 
 int computeEwGreenSeconds() {
-  int extra = 0;
-  if (trafficCountEW >= 15) {
-    extra = 30;
-  } else if (trafficCountEW >= 10) {
-    extra = 20;
-  } else if (trafficCountEW >= 5) {
-    extra = 10;
+  int secs = queueClearanceSeconds(ewDischarge, trafficCountEW * ewQueueGain) +
+             splitFailureBiasSeconds(ewSplitFailRate);
+  return constrain(secs, BASE_GREEN_SEC, MAX_GREEN_SEC);
+}
+
+// Judges the previous green once its residual window has closed
+bool updateSplitFailure(float &rate, int &consecutive, int queueAtGreen,
+                        int residualCalls, unsigned long endGapMs, float occAtEnd) {
+  bool noGapOut = (endGapMs < SF_END_GAP_MS || occAtEnd >= OCC_QUEUE_FRACTION);
+  bool failed = (queueAtGreen >= SF_MIN_QUEUE && noGapOut && residualCalls > 0);
+  rate += SF_RATE_ALPHA * ((failed ? 1.0 : 0.0) - rate);
+  consecutive = failed ? consecutive + 1 : 0;
+  return failed;
+}
+
+int splitFailureBiasSeconds(float rate) {
+  return (int)(rate * SF_MAX_BIAS_SEC + 0.5);
+}
+
+void splitFailurePrintReport() {
+  Serial.print("split fail NS rate=");
+  Serial.print(nsSplitFailRate, 2);
+  Serial.print(" run=");
+  Serial.print(nsConsecutiveSplitFails);
+  Serial.print(" total=");
+  Serial.println(nsSplitFails);
+  Serial.print("split fail EW rate=");
+  Serial.print(ewSplitFailRate, 2);
+  Serial.print(" run=");
+  Serial.print(ewConsecutiveSplitFails);
+  Serial.print(" total=");
+  Serial.println(ewSplitFails);
+}
+
+void computeClearanceIntervals() {
+  nsYellowMs = yellowIntervalMs(NS_APPROACH_SPEED_KMH, NS_APPROACH_GRADE_PCT);
+  nsAllRedMs = allRedIntervalMs(NS_APPROACH_SPEED_KMH, NS_CROSSING_WIDTH_M);
+  ewYellowMs = yellowIntervalMs(EW_APPROACH_SPEED_KMH, EW_APPROACH_GRADE_PCT);
+  ewAllRedMs = allRedIntervalMs(EW_APPROACH_SPEED_KMH, EW_CROSSING_WIDTH_M);
+  pedClearanceSec = 0;
+  for (int i = 0; i < PED_CROSSWALKS; i++) {
+    int secs = (int)ceil(PED_CROSSWALK_LENGTH_M[i] / PED_WALK_SPEED_MPS);
+    if (secs > pedClearanceSec) pedClearanceSec = secs;
+  }
+}
+
+// ITE kinematic change interval: Y = t + v / (2a + 2Gg), rounded up to 0.1 s
+unsigned long yellowIntervalMs(float speedKmh, float gradePct) {
+  float v = speedKmh / 3.6;
+  float secs = PERCEPTION_REACTION_SEC +
+               v / (2.0 * DECEL_RATE_MPS2 + 2.0 * (gradePct / 100.0) * GRAVITY_MPS2);
+  unsigned long ms = (unsigned long)ceil(secs * 10.0) * 100;
+  return constrain(ms, MIN_YELLOW_MS, MAX_YELLOW_MS);
+}
+
+// ITE clearance interval: R = (W + L) / v, rounded up to 0.1 s
+unsigned long allRedIntervalMs(float speedKmh, float crossingWidthM) {
+  float v = speedKmh / 3.6;
+  float secs = (crossingWidthM + VEHICLE_LENGTH_M) / v;
+  unsigned long ms = (unsigned long)ceil(secs * 10.0) * 100;
+  return min(ms, MAX_ALL_RED_MS);
+}
+
+void computeAdvanceTravelTimes() {
+  nsAdvanceTravelMs = (unsigned long)(NS_ADVANCE_DIST_M / (NS_APPROACH_SPEED_KMH / 3.6) * 1000.0);
+  ewAdvanceTravelMs = (unsigned long)(EW_ADVANCE_DIST_M / (EW_APPROACH_SPEED_KMH / 3.6) * 1000.0);
+  // The stop-bar loop releases once the rear of the vehicle has crossed it
+  nsReleaseTravelMs = nsAdvanceTravelMs +
+      (unsigned long)((DETECTOR_LENGTH_M + VEHICLE_LENGTH_M) / (NS_APPROACH_SPEED_KMH / 3.6) * 1000.0);
+  ewReleaseTravelMs = ewAdvanceTravelMs +
+      (unsigned long)((DETECTOR_LENGTH_M + VEHICLE_LENGTH_M) / (EW_APPROACH_SPEED_KMH / 3.6) * 1000.0);
+}
+
+// Bins are keyed by absolute second, so stale bins are reset lazily on reuse
+void recordPredictedArrival(uint8_t bins[], unsigned long binSec[], unsigned long arrivalSec) {
+  int i = arrivalSec % ARRIVAL_HORIZON_SEC;
+  if (binSec[i] != arrivalSec) {
+    binSec[i] = arrivalSec;
+    bins[i] = 0;
+  }
+  if (bins[i] < 255) bins[i]++;
+}
+
+int predictedArrivals(const uint8_t bins[], const unsigned long binSec[],
+                      unsigned long fromSec, int spanSec) {
+  int total = 0;
+  for (unsigned long t = fromSec; t < fromSec + spanSec; t++) {
+    int i = t % ARRIVAL_HORIZON_SEC;
+    if (binSec[i] == t) total += bins[i];
+  }
+  return total;
+}
+
+bool nsPlatoonArriving(unsigned long delayMs) {
+  return predictedArrivals(nsArrivalBins, nsArrivalBinSec, (millis() + delayMs) / 1000,
+                           PLATOON_LOOKAHEAD_SEC) >= PLATOON_MIN_VEHICLES;
+}
+
+bool ewPlatoonArriving(unsigned long delayMs) {
+  return predictedArrivals(ewArrivalBins, ewArrivalBinSec, (millis() + delayMs) / 1000,
+                           PLATOON_LOOKAHEAD_SEC) >= PLATOON_MIN_VEHICLES;
+}
+
+// Constant work per poll sample: integrate occupied time, smooth it, and
+// classify each completed hold
+void presenceSample(Presence& p, bool occupied, unsigned long nowMs, float speedKmh) {
+  unsigned long dtMs = nowMs - p.lastSampleMs;
+  p.lastSampleMs = nowMs;
+  if (p.occupied) p.intervalOccupiedMs += dtMs;
+
+  float w = min(dtMs / OCC_SHORT_TAU_MS, 1.0f);
+  p.shortOcc += w * ((p.occupied ? 1.0 : 0.0) - p.shortOcc);
+
+  if (nowMs - p.intervalStartMs >= OCC_INTERVAL_MS) {
+    p.intervalOccPct = 100.0 * p.intervalOccupiedMs / (nowMs - p.intervalStartMs);
+    p.intervalStartMs = nowMs;
+    p.intervalOccupiedMs = 0;
+  }
+
+  if (occupied && !p.occupied) {
+    p.holdStartMs = nowMs;
+  } else if (!occupied && p.occupied) {
+    presenceClassify(p, nowMs - p.holdStartMs, speedKmh);
+  }
+  p.occupied = occupied;
+}
+
+// Effective length = speed x hold time - detector length
+void presenceClassify(Presence& p, unsigned long holdMs, float speedKmh) {
+  if (holdMs >= PRESENCE_STOPPED_MS) {
+    p.lengthClass[LENGTH_STOPPED]++;
+    return;
+  }
+  float lengthM = speedKmh / 3.6 * holdMs / 1000.0 - DETECTOR_LENGTH_M;
+  if (lengthM >= LENGTH_CLASS_LONG_M) {
+    p.lengthClass[LENGTH_LONG]++;
+  } else if (lengthM >= LENGTH_CLASS_MEDIUM_M) {
+    p.lengthClass[LENGTH_MEDIUM]++;
   } else {
-    extra = 0;
+    p.lengthClass[LENGTH_SHORT]++;
+  }
+}
+
+// Free-flowing traffic crosses the detector in short pulses; a discharging
+// queue keeps it occupied most of the time
+bool queueDischarging(const Presence& p) {
+  return p.shortOcc >= OCC_QUEUE_FRACTION;
+}
+
+void presencePrintReport() {
+  const Presence* dets[2] = { &nsPresence, &ewPresence };
+  const char* names[2] = { "NS", "EW" };
+  for (int i = 0; i < 2; i++) {
+    Serial.print(names[i]);
+    Serial.print(" occ=");
+    Serial.print(dets[i]->intervalOccPct, 1);
+    Serial.print("% now=");
+    Serial.print(dets[i]->shortOcc * 100.0, 0);
+    Serial.print("% short=");
+    Serial.print(dets[i]->lengthClass[LENGTH_SHORT]);
+    Serial.print(" medium=");
+    Serial.print(dets[i]->lengthClass[LENGTH_MEDIUM]);
+    Serial.print(" long=");
+    Serial.print(dets[i]->lengthClass[LENGTH_LONG]);
+    Serial.print(" stopped=");
+    Serial.println(dets[i]->lengthClass[LENGTH_STOPPED]);
+  }
+}
+
+void pairPushAdvance(PairFifo& fifo, unsigned long nowMs) {
+  if (fifo.count == PAIR_FIFO_SLOTS) {
+    fifo.head = (fifo.head + 1) % PAIR_FIFO_SLOTS;
+    fifo.count--;
+    fifo.overflows++;
+  }
+  fifo.advanceMs[(fifo.head + fifo.count) % PAIR_FIFO_SLOTS] = nowMs;
+  fifo.count++;
+}
+
+// Pairs a stop-bar release with the oldest unmatched advance actuation.
+// Implausibly slow heads were missed at the stop bar and are discarded;
+// an implausibly fast match means this vehicle was missed upstream.
+void pairMatchStopBar(PairFifo& fifo, unsigned long nowMs, unsigned long freeFlowMs,
+                      RunningStats& travel, RunningStats& delaySec, Histogram& delayHist) {
+  unsigned long minMs = (unsigned long)(freeFlowMs * PAIR_MIN_TT_FRACTION);
+  unsigned long maxMs = freeFlowMs + PAIR_MAX_EXTRA_MS;
+
+  while (fifo.count > 0 && nowMs - fifo.advanceMs[fifo.head] > maxMs) {
+    fifo.head = (fifo.head + 1) % PAIR_FIFO_SLOTS;
+    fifo.count--;
+    fifo.overflows++;
   }
-  return BASE_GREEN_SEC + extra;
+  if (fifo.count == 0 || nowMs - fifo.advanceMs[fifo.head] < minMs) {
+    fifo.underflows++;
+    return;
+  }
+
+  unsigned long travelMs = nowMs - fifo.advanceMs[fifo.head];
+  fifo.head = (fifo.head + 1) % PAIR_FIFO_SLOTS;
+  fifo.count--;
+
+  unsigned long delayMs = travelMs > freeFlowMs ? travelMs - freeFlowMs : 0;
+  statsAdd(travel, travelMs / 1000.0);
+  statsAdd(delaySec, delayMs / 1000.0);
+  histRecord(delayHist, delayMs);
+}
+
+void statsAdd(RunningStats& st, float x) {
+  st.n++;
+  float d = x - st.mean;
+  st.mean += d / st.n;
+  st.m2 += d * (x - st.mean);
+  if (x > st.maxValue) st.maxValue = x;
+}
+
+void statsPrint(const char* name, const RunningStats& st) {
+  Serial.print(name);
+  Serial.print(" n=");
+  Serial.print(st.n);
+  Serial.print(" mean=");
+  Serial.print(st.mean, 1);
+  Serial.print(" sd=");
+  Serial.print(st.n > 1 ? sqrt(st.m2 / (st.n - 1)) : 0.0, 1);
+  Serial.print(" max=");
+  Serial.println(st.maxValue, 1);
+}
+
+void travelPrintReport() {
+  statsPrint("NS travel s", nsTravelSec);
+  statsPrint("NS delay s ", nsDelaySec);
+  Serial.print("NS unmatched adv=");
+  Serial.print(nsPairs.overflows);
+  Serial.print(" stop=");
+  Serial.println(nsPairs.underflows);
+  statsPrint("EW travel s", ewTravelSec);
+  statsPrint("EW delay s ", ewDelaySec);
+  Serial.print("EW unmatched adv=");
+  Serial.print(ewPairs.overflows);
+  Serial.print(" stop=");
+  Serial.println(ewPairs.underflows);
+}
+
+void arrivalsOnGreenPrintReport() {
+  Serial.print("NS arrivals=");
+  Serial.print(nsArrivals);
+  Serial.print(" on green=");
+  Serial.print(nsArrivalsOnGreen);
+  Serial.print(" AOG=");
+  Serial.print(nsArrivals > 0 ? 100.0 * nsArrivalsOnGreen / nsArrivals : 0.0, 1);
+  Serial.println("%");
+  Serial.print("EW arrivals=");
+  Serial.print(ewArrivals);
+  Serial.print(" on green=");
+  Serial.print(ewArrivalsOnGreen);
+  Serial.print(" AOG=");
+  Serial.print(ewArrivals > 0 ? 100.0 * ewArrivalsOnGreen / ewArrivals : 0.0, 1);
+  Serial.println("%");
 }
 
 void lcdShowTwoLines(const char* line1, const char* line2) {
@@ -315,37 +1223,52 @@ void setEwGreenState() {
 }
 
 void phaseEwYellow() {
-  currentPhase = PHASE_EW_YELLOW;
-  for (int remaining = YELLOW_TIME_SEC; remaining > 0; remaining--) {
+  setEwYellowState();             // before any LCD or log work
+  enterPhase(PHASE_EW_YELLOW);
+  unsigned long remainingMs = ewYellowMs;
+  while (remainingMs > 0) {
+    unsigned long stepMs = remainingMs % 1000;   // fractional second first
+    if (stepMs == 0) stepMs = 1000;
+
     lcd.clear();
     lcd.setCursor(0, 0);
     lcd.print("EW Yellow T=");
-    lcd.print(remaining);
+    lcd.print((remainingMs + 999) / 1000);
     lcd.print("s");
 
     lcd.setCursor(0, 1);
     lcd.print("NS=");
     lcd.print(trafficCountNS);
 
-    setEwYellowState();
-    waitOneSecondWithButtons();
+    waitMillisWithButtons(stepMs);
+    remainingMs -= stepMs;
   }
 }
 
-void setEwYellowState() {
+void phaseEwAllRed() {
+  enterPhase(PHASE_EW_ALL_RED);
   setAllVehicleRed();
-  digitalWrite(PIN_EW_RED, LOW);
+  lcdShowTwoLines("EW All Red", "Clearance");
+  waitMillisWithButtons(ewAllRedMs);
+}
+
+// Yellow only ever follows green or flashing yellow, so never pass through red
+void setEwYellowState() {
   digitalWrite(PIN_EW_YELLOW, HIGH);
+  digitalWrite(PIN_EW_GREEN, LOW);
+  digitalWrite(PIN_EW_RED, LOW);
 }
 
 void phasePedestrianIfRequested() {
   if (!pedRequest) return;   
 
-  currentPhase = PHASE_PED_GREEN;
+  enterPhase(PHASE_PED_GREEN);
 
   setPedestrianGreenState();
+  histRecord(latPedCallToWalk, micros() - pedCallUs);
+  histRecord(pedWaitHist, (micros() - pedCallUs) / 1000);
 
-  for (int remaining = PED_TIME_SEC; remaining > 0; remaining--) {
+  for (int remaining = computePedWalkSeconds(); remaining > 0; remaining--) {
     lcd.clear();
     lcd.setCursor(0, 0);
     lcd.print("PEDESTRIAN");
@@ -357,6 +1280,24 @@ void phasePedestrianIfRequested() {
     waitOneSecondWithButtons();
   }
 
+  // Clearance: flashing DONT WALK (ped red) long enough to finish crossing
+  digitalWrite(PIN_PED_GREEN, LOW);
+  pedClearing = true;
+  for (int remaining = pedClearanceSec; remaining > 0; remaining--) {
+    lcd.clear();
+    lcd.setCursor(0, 0);
+    lcd.print("PEDESTRIAN");
+    lcd.setCursor(0, 1);
+    lcd.print("T=");
+    lcd.print(remaining);
+    lcd.print(" DONT WALK");
+
+    digitalWrite(PIN_PED_RED, HIGH);
+    waitMillisWithButtons(500);
+    digitalWrite(PIN_PED_RED, LOW);
+    waitMillisWithButtons(500);
+  }
+
   setAllVehicleRed();
   digitalWrite(PIN_PED_RED, HIGH);
   digitalWrite(PIN_PED_GREEN, LOW);
@@ -364,7 +1305,23 @@ void phasePedestrianIfRequested() {
   lcdShowTwoLines("PEDESTRIAN", "STOP");
   delay(500);
 
-  pedRequest = false;
+  pedClearing = false;
+  pedRequest = pedNextPressCount > 0;
+  pedPressCount = pedNextPressCount;
+  pedCallUs = pedNextCallUs;
+  pedNextPressCount = 0;
+  pedServedThisCycle = true;
+}
+
+// How long a pending pedestrian phase will delay the next vehicle green
+unsigned long pedPhaseMs() {
+  if (!pedRequest) return 0;
+  return (computePedWalkSeconds() + pedClearanceSec) * 1000UL + 500;   // + STOP hold
+}
+
+int computePedWalkSeconds() {
+  float walk = PED_MIN_WALK_SEC + (pedPressCount - 1) * PED_WALK_SEC_PER_PRESS;
+  return constrain((int)ceil(walk), PED_MIN_WALK_SEC, PED_MAX_WALK_SEC);
 }
 
 void setPedestrianGreenState() {
@@ -372,3 +1329,525 @@ void setPedestrianGreenState() {
   digitalWrite(PIN_PED_RED, LOW);
   digitalWrite(PIN_PED_GREEN, HIGH);
 }
+
+void runFlashMode() {
+  enterPhase(PHASE_FLASH);
+  setFlashState();
+  lcdShowTwoLines("FLASH MODE", "Low demand");
+
+  while (trafficCountEW == 0 && !pedRequest &&
+         predictedArrivals(ewArrivalBins, ewArrivalBinSec, millis() / 1000,
+                           ARRIVAL_HORIZON_SEC) == 0) {
+    waitOneSecondWithButtons();
+  }
+
+  clearFlashState();
+  lowDemandCycles = 0;
+}
+
+void setFlashState() {
+  setAllVehicleRed();
+  digitalWrite(PIN_NS_RED, LOW);
+  digitalWrite(PIN_PED_RED, HIGH);
+  digitalWrite(PIN_PED_GREEN, LOW);
+
+  startLedcFlash(PIN_NS_YELLOW, FLASH_LEDC_CH_MAIN);
+  startLedcFlash(PIN_EW_RED, FLASH_LEDC_CH_SIDE);
+}
+
+// Leaves NS on steady yellow: flashing yellow must never pass through red
+void clearFlashState() {
+  stopLedcFlash(PIN_NS_YELLOW);
+  digitalWrite(PIN_NS_YELLOW, HIGH);
+  stopLedcFlash(PIN_EW_RED);
+  digitalWrite(PIN_EW_RED, HIGH);
+}
+
+void startLedcFlash(int pin, int channel) {
+  uint32_t halfDuty = 1UL << (FLASH_LEDC_RES_BITS - 1);
+#if ESP_ARDUINO_VERSION_MAJOR >= 3
+  ledcAttachChannel(pin, FLASH_FREQ_HZ, FLASH_LEDC_RES_BITS, channel);
+  ledcWrite(pin, halfDuty);
+#else
+  ledcSetup(channel, FLASH_FREQ_HZ, FLASH_LEDC_RES_BITS);
+  ledcAttachPin(pin, channel);
+  ledcWrite(channel, halfDuty);
+#endif
+}
+
+void stopLedcFlash(int pin) {
+#if ESP_ARDUINO_VERSION_MAJOR >= 3
+  ledcDetach(pin);
+#else
+  ledcDetachPin(pin);
+#endif
+  pinMode(pin, OUTPUT);   // hand the pin back to digitalWrite()
+}
+
+void enterPhase(Phase phase) {
+  currentPhase = phase;
+  logEvent(LOG_PHASE, phase, 0);
+}
+
+// The log is a ring over the whole partition: every sector is erased once per
+// lap, and the newest page is found at boot as the highest valid sequence.
+void logInit() {
+  logPartition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+                                          ESP_PARTITION_SUBTYPE_DATA_SPIFFS, NULL);
+  logBuffer.count = 0;
+  logLastFlushMs = millis();
+  if (logPartition == NULL) {
+    Serial.println("log: no data partition, logging disabled");
+    return;
+  }
+
+  logPageCount = logPartition->size / LOG_PAGE_BYTES;
+  uint32_t newestSeq = 0;
+  bool found = false;
+  for (uint32_t i = 0; i < logPageCount; i++) {
+    uint32_t seq;
+    esp_partition_read(logPartition, i * LOG_PAGE_BYTES, &seq, sizeof(seq));
+    if (seq == LOG_SEQ_ERASED) continue;
+    if (!found || seq > newestSeq) {
+      newestSeq = seq;
+      logHeadPage = (i + 1) % logPageCount;
+      found = true;
+    }
+  }
+  logNextSeq = found ? newestSeq + 1 : 0;
+}
+
+void logEvent(uint8_t type, uint8_t arg, uint16_t value) {
+  LogRecord& rec = logBuffer.records[logBuffer.count++];
+  rec.timeMs = millis();
+  rec.type   = type;
+  rec.arg    = arg;
+  rec.value  = value;
+  logRecordsWritten++;
+  if (logBuffer.count == LOG_RECORDS_PER_PAGE) logFlush();
+}
+
+void logFlush() {
+  if (logBuffer.count == 0) return;
+  logLastFlushMs = millis();
+  if (logPartition == NULL) {
+    logBuffer.count = 0;
+    return;
+  }
+
+  uint32_t offset = logHeadPage * LOG_PAGE_BYTES;
+  uint32_t seq;
+  esp_partition_read(logPartition, offset, &seq, sizeof(seq));
+  if (offset % LOG_SECTOR_BYTES == 0 || seq != LOG_SEQ_ERASED) {
+    uint32_t sector = offset - offset % LOG_SECTOR_BYTES;
+    esp_partition_erase_range(logPartition, sector, LOG_SECTOR_BYTES);
+    logSectorsErased++;
+  }
+
+  // Unused record slots stay 0xFF so a partial page programs fewer bits
+  memset(&logBuffer.records[logBuffer.count], 0xFF,
+         (LOG_RECORDS_PER_PAGE - logBuffer.count) * sizeof(LogRecord));
+  logBuffer.seq = logNextSeq++;
+  logBuffer.crc = logPageCrc(logBuffer);
+  esp_partition_write(logPartition, offset, &logBuffer, LOG_PAGE_BYTES);
+  logPagesWritten++;
+
+  logHeadPage = (logHeadPage + 1) % logPageCount;
+  logBuffer.count = 0;
+}
+
+void logFlushIfDue() {
+  if (millis() - logLastFlushMs >= LOG_FLUSH_INTERVAL_MS) logFlush();
+}
+
+uint16_t logPageCrc(const LogPage& page) {
+  uint16_t crc = 0xFFFF;
+  crc = crc16Update(crc, (const uint8_t*)&page.seq, sizeof(page.seq));
+  crc = crc16Update(crc, (const uint8_t*)&page.count, sizeof(page.count));
+  crc = crc16Update(crc, (const uint8_t*)page.records, page.count * sizeof(LogRecord));
+  return crc;
+}
+
+uint16_t crc16Update(uint16_t crc, const uint8_t* data, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    crc ^= (uint16_t)data[i] << 8;
+    for (int b = 0; b < 8; b++) {
+      crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : (crc << 1);
+    }
+  }
+  return crc;
+}
+
+// Dumps oldest-to-newest as CSV, a few records per tick so signal timing
+// never waits on the UART.
+void logStartDump() {
+  logFlush();
+  Serial.println("seq,time_ms,type,arg,value");
+  logDumpActive    = true;
+  logDumpPagesLeft = logPageCount;
+  logDumpPageIdx   = logHeadPage;
+  logDumpRecIdx    = 0;
+  logDumpPage.count = 0;
+}
+
+void logServiceDump() {
+  int pagesScanned = 0;
+  while (logDumpActive && Serial.availableForWrite() >= 40) {
+    if (logDumpRecIdx < logDumpPage.count) {
+      logPrintRecord(logDumpPage.seq, logDumpPage.records[logDumpRecIdx++]);
+      continue;
+    }
+    if (logDumpPagesLeft == 0 || pagesScanned == 16) {
+      if (logDumpPagesLeft == 0) {
+        Serial.println("END");
+        logDumpActive = false;
+      }
+      return;
+    }
+
+    esp_partition_read(logPartition, logDumpPageIdx * LOG_PAGE_BYTES,
+                       &logDumpPage, LOG_PAGE_BYTES);
+    logDumpPageIdx = (logDumpPageIdx + 1) % logPageCount;
+    logDumpPagesLeft--;
+    pagesScanned++;
+    logDumpRecIdx = 0;
+    if (logDumpPage.seq == LOG_SEQ_ERASED ||
+        logDumpPage.count > LOG_RECORDS_PER_PAGE ||
+        logDumpPage.crc != logPageCrc(logDumpPage)) {
+      logDumpPage.count = 0;   // blank or torn page
+    }
+  }
+}
+
+void logPrintRecord(uint32_t seq, const LogRecord& rec) {
+  Serial.print(seq);
+  Serial.print(',');
+  Serial.print(rec.timeMs);
+  Serial.print(',');
+  Serial.print(rec.type);
+  Serial.print(',');
+  Serial.print(rec.arg);
+  Serial.print(',');
+  Serial.println(rec.value);
+}
+
+void logPrintStats() {
+  Serial.print("log pages=");
+  Serial.print(logPageCount);
+  Serial.print(" head=");
+  Serial.print(logHeadPage);
+  Serial.print(" seq=");
+  Serial.println(logNextSeq);
+
+  // Write amplification: flash bytes programmed per byte of record payload
+  Serial.print("records=");
+  Serial.print(logRecordsWritten);
+  Serial.print(" pages=");
+  Serial.print(logPagesWritten);
+  Serial.print(" erases=");
+  Serial.print(logSectorsErased);
+  Serial.print(" WA=");
+  if (logRecordsWritten > 0) {
+    Serial.println((float)logPagesWritten * LOG_PAGE_BYTES /
+                   (logRecordsWritten * sizeof(LogRecord)), 2);
+  } else {
+    Serial.println("-");
+  }
+}
+
+void pollSerialCommands() {
+  if (logDumpActive) logServiceDump();
+  if (!Serial.available()) return;
+
+  switch (Serial.read()) {
+    case 'D':
+      if (logPartition != NULL) logStartDump();
+      break;
+    case 'S':
+      logPrintStats();
+      break;
+    case 'H':
+      countPrintBlock();
+      break;
+    case 'L':
+      latPrintReport();
+      break;
+    case 'G':
+      arrivalsOnGreenPrintReport();
+      break;
+    case 'F':
+      splitFailurePrintReport();
+      break;
+    case 'T':
+      travelPrintReport();
+      break;
+    case 'O':
+      presencePrintReport();
+      break;
+    case 'Q':
+      dischargePrintReport();
+      break;
+    case 'C':
+      costPrintReport();
+      break;
+    case 'M':
+      metricsPrintReport();
+      break;
+    case 'Z':
+      histReset(latInputToCount);
+      histReset(latInputToDisplay);
+      histReset(latPedCallToWalk);
+      histReset(latVehCallToGreen);
+      break;
+  }
+}
+
+void histRecord(Histogram& h, uint32_t value) {
+  h.buckets[histBucket(value)]++;
+  h.count++;
+  if (value > h.maxValue) h.maxValue = value;
+}
+
+void histReset(Histogram& h) {
+  memset(&h, 0, sizeof(h));
+}
+
+int histBucket(uint32_t value) {
+  const uint32_t subCount = 1 << HIST_SUB_BITS;
+  if (value < subCount) return value;
+  int msb = 31 - __builtin_clz(value);
+  int shift = msb - HIST_SUB_BITS;
+  return ((shift + 1) << HIST_SUB_BITS) + ((value >> shift) & (subCount - 1));
+}
+
+uint32_t histBucketUpper(int bucket) {
+  const uint32_t subCount = 1 << HIST_SUB_BITS;
+  if (bucket < (int)subCount) return bucket;
+  int shift = (bucket >> HIST_SUB_BITS) - 1;
+  uint32_t lower = (subCount + (bucket & (subCount - 1))) << shift;
+  return lower + ((1UL << shift) - 1);
+}
+
+// Upper edge of the bucket holding the q-quantile, capped at the true max
+uint32_t histPercentile(const Histogram& h, float q) {
+  if (h.count == 0) return 0;
+  uint32_t rank = (uint32_t)ceil(q * h.count);
+  if (rank == 0) rank = 1;
+  uint32_t seen = 0;
+  for (int b = 0; b < HIST_BUCKETS; b++) {
+    seen += h.buckets[b];
+    if (seen >= rank) return min(histBucketUpper(b), h.maxValue);
+  }
+  return h.maxValue;
+}
+
+// Same bucket layout everywhere, so merging is a bucket-wise add
+void histMerge(Histogram& into, const Histogram& from) {
+  for (int b = 0; b < HIST_BUCKETS; b++) {
+    into.buckets[b] += from.buckets[b];
+  }
+  into.count += from.count;
+  if (from.maxValue > into.maxValue) into.maxValue = from.maxValue;
+}
+
+void histPrint(const char* name, const Histogram& h) {
+  Serial.print(name);
+  Serial.print(" n=");
+  Serial.print(h.count);
+  Serial.print(" p50=");
+  Serial.print(histPercentile(h, 0.50));
+  Serial.print(" p95=");
+  Serial.print(histPercentile(h, 0.95));
+  Serial.print(" p99=");
+  Serial.print(histPercentile(h, 0.99));
+  Serial.print(" max=");
+  Serial.println(h.maxValue);
+}
+
+void metricsPrintReport() {
+  static Histogram merged;
+
+  histPrint("NS delay ms", nsDelayHist);
+  histPrint("EW delay ms", ewDelayHist);
+  histReset(merged);
+  histMerge(merged, nsDelayHist);
+  histMerge(merged, ewDelayHist);
+  histPrint("all delay ms", merged);
+
+  histPrint("NS queue", nsQueueHist);
+  histPrint("EW queue", ewQueueHist);
+  histReset(merged);
+  histMerge(merged, nsQueueHist);
+  histMerge(merged, ewQueueHist);
+  histPrint("all queue", merged);
+
+  histPrint("ped wait ms", pedWaitHist);
+}
+
+void latPrintReport() {
+  Serial.println("latency (us)");
+  histPrint("input->count  ", latInputToCount);
+  histPrint("input->display", latInputToDisplay);
+  histPrint("ped call->walk", latPedCallToWalk);
+  histPrint("veh call->green", latVehCallToGreen);
+}
+
+// Per-controller state that a second junction on this board would duplicate:
+// every global below the I/O and log layers, padding between them excluded
+size_t controllerStateBytes() {
+  return sizeof(currentPhase) + sizeof(countPacked) + sizeof(countOverflow) +
+         sizeof(countCurrentBin) + sizeof(countBinStartMs) + sizeof(countSaturated) +
+         sizeof(latInputToCount) + sizeof(latInputToDisplay) +
+         sizeof(latPedCallToWalk) + sizeof(latVehCallToGreen) + sizeof(nsDelayHist) +
+         sizeof(ewDelayHist) + sizeof(nsQueueHist) + sizeof(ewQueueHist) +
+         sizeof(pedWaitHist) + sizeof(pedCallUs) + sizeof(nsCallUs) +
+         sizeof(ewCallUs) + sizeof(nsPresence) + sizeof(ewPresence) +
+         sizeof(nsDischarge) + sizeof(ewDischarge) + sizeof(nsPairs) + sizeof(ewPairs) +
+         sizeof(nsTravelSec) + sizeof(ewTravelSec) + sizeof(nsDelaySec) +
+         sizeof(ewDelaySec) + sizeof(nsYellowMs) + sizeof(nsAllRedMs) +
+         sizeof(ewYellowMs) + sizeof(ewAllRedMs) + sizeof(trafficCountNS) +
+         sizeof(trafficCountEW) + sizeof(pedRequest) + sizeof(pedPressCount) +
+         sizeof(pedClearanceSec) + sizeof(pedClearing) + sizeof(pedNextPressCount) +
+         sizeof(pedNextCallUs) + sizeof(nsQueueGain) + sizeof(ewQueueGain) +
+         sizeof(nsGreenStartMs) + sizeof(ewGreenStartMs) + sizeof(nsGreenEndMs) +
+         sizeof(ewGreenEndMs) + sizeof(nsLastGreenCallMs) + sizeof(ewLastGreenCallMs) +
+         sizeof(nsWastedGreenMs) + sizeof(ewWastedGreenMs) + sizeof(nsResidualCalls) +
+         sizeof(ewResidualCalls) + sizeof(nsWasExtended) + sizeof(ewWasExtended) +
+         sizeof(nsOccAtGreenEnd) + sizeof(ewOccAtGreenEnd) + sizeof(nsSplitFailRate) +
+         sizeof(ewSplitFailRate) + sizeof(nsConsecutiveSplitFails) +
+         sizeof(ewConsecutiveSplitFails) + sizeof(nsSplitFails) +
+         sizeof(ewSplitFails) + sizeof(nsCallsAtGreen) + sizeof(ewCallsAtGreen) +
+         sizeof(pedServedThisCycle) + sizeof(lowDemandCycles) +
+         sizeof(lastNsBtnState) + sizeof(lastEwBtnState) + sizeof(lastPedBtnState) +
+         sizeof(lastNsAdvBtnState) + sizeof(lastEwAdvBtnState) +
+         sizeof(nsAdvanceTravelMs) + sizeof(ewAdvanceTravelMs) +
+         sizeof(nsReleaseTravelMs) + sizeof(ewReleaseTravelMs) +
+         sizeof(nsArrivalBins) + sizeof(ewArrivalBins) + sizeof(nsArrivalBinSec) +
+         sizeof(ewArrivalBinSec) + sizeof(nsArrivals) + sizeof(ewArrivals) +
+         sizeof(nsArrivalsOnGreen) + sizeof(ewArrivalsOnGreen);
+}
+
+void costPrintReport() {
+  float cpuPct = ctlWallUs > 0 ? 100.0 * (ctlWallUs - ctlIdleUs) / ctlWallUs : 0;
+
+  Serial.print("cost cpu=");
+  Serial.print(cpuPct, 2);
+  Serial.print("% state=");
+  Serial.print(controllerStateBytes());
+  Serial.print("B heap_free=");
+  Serial.println(ESP.getFreeHeap());
+
+  // Blocking delays (debounce, LCD) count as busy: they would stall a shared tick
+  Serial.print("fit by cpu=");
+  Serial.print(cpuPct > 0 ? (int)(100.0 / cpuPct) : 0);
+  Serial.print(" by ram=");
+  Serial.println(ESP.getFreeHeap() / controllerStateBytes());
+}
+
+void countInit() {
+  memset(countPacked, 0, sizeof(countPacked));
+  for (int i = 0; i < COUNT_OVERFLOW_SLOTS; i++) {
+    countOverflow[i].bin = COUNT_SLOT_FREE;
+  }
+  countCurrentBin = 0;
+  countBinStartMs = millis();
+}
+
+void countRecord(int series) {
+  countAdvanceBins();
+  int idx = series * COUNT_BINS + countCurrentBin % COUNT_BINS;
+  uint8_t field = countGetField(idx);
+
+  if (field < COUNT_ESCAPE - 1) {
+    countSetField(idx, field + 1);
+  } else if (field == COUNT_ESCAPE - 1) {
+    int slot = countFindOverflow(COUNT_SLOT_FREE);
+    if (slot < 0) {
+      countSaturated++;
+      return;
+    }
+    countOverflow[slot].bin   = idx;
+    countOverflow[slot].count = COUNT_ESCAPE;
+    countSetField(idx, COUNT_ESCAPE);
+  } else {
+    int slot = countFindOverflow(idx);
+    if (countOverflow[slot].count < 0xFFFF) countOverflow[slot].count++;
+  }
+}
+
+// Zeroes every bin the clock has moved past, releasing their overflow slots
+void countAdvanceBins() {
+  while (millis() - countBinStartMs >= COUNT_BIN_MS) {   // wrap-safe difference
+    countBinStartMs += COUNT_BIN_MS;
+    countCurrentBin++;
+    int slot = countCurrentBin % COUNT_BINS;
+    for (int series = 0; series < COUNT_SERIES; series++) {
+      int idx = series * COUNT_BINS + slot;
+      if (countGetField(idx) == COUNT_ESCAPE) {
+        countOverflow[countFindOverflow(idx)].bin = COUNT_SLOT_FREE;
+      }
+      countSetField(idx, 0);
+    }
+  }
+}
+
+uint8_t countGetField(int idx) {
+  int bit = idx * COUNT_FIELD_BITS;
+  int byteIdx = bit / 8;
+  uint16_t word = countPacked[byteIdx];
+  if (byteIdx + 1 < (int)sizeof(countPacked)) word |= countPacked[byteIdx + 1] << 8;
+  return (word >> (bit % 8)) & ((1 << COUNT_FIELD_BITS) - 1);
+}
+
+void countSetField(int idx, uint8_t value) {
+  int bit = idx * COUNT_FIELD_BITS;
+  int byteIdx = bit / 8;
+  uint16_t mask = ((1 << COUNT_FIELD_BITS) - 1) << (bit % 8);
+  uint16_t bits = (uint16_t)value << (bit % 8);
+  countPacked[byteIdx] = (countPacked[byteIdx] & ~mask) | (bits & 0xFF);
+  if (byteIdx + 1 < (int)sizeof(countPacked)) {
+    countPacked[byteIdx + 1] = (countPacked[byteIdx + 1] & ~(mask >> 8)) | (bits >> 8);
+  }
+}
+
+int countFindOverflow(int idx) {
+  for (int i = 0; i < COUNT_OVERFLOW_SLOTS; i++) {
+    if (countOverflow[i].bin == idx) return i;
+  }
+  return -1;
+}
+
+uint16_t countBinValue(int series, int slot) {
+  int idx = series * COUNT_BINS + slot;
+  uint8_t field = countGetField(idx);
+  return field == COUNT_ESCAPE ? countOverflow[countFindOverflow(idx)].count : field;
+}
+
+// One block: header line, packed fields, then the overflow table, all hex
+void countPrintBlock() {
+  countAdvanceBins();
+  Serial.print("HIST bin_min=15 bins=");
+  Serial.print(COUNT_BINS);
+  Serial.print(" series=");
+  Serial.print(COUNT_SERIES);
+  Serial.print(" bits=");
+  Serial.print(COUNT_FIELD_BITS);
+  Serial.print(" current=");
+  Serial.print(countCurrentBin % COUNT_BINS);
+  Serial.print(" saturated=");
+  Serial.println(countSaturated);
+
+  for (size_t i = 0; i < sizeof(countPacked); i++) {
+    if (countPacked[i] < 0x10) Serial.print('0');
+    Serial.print(countPacked[i], HEX);
+    if (i % 32 == 31) Serial.println();
+  }
+  Serial.println();
+  for (int i = 0; i < COUNT_OVERFLOW_SLOTS; i++) {
+    if (countOverflow[i].bin == COUNT_SLOT_FREE) continue;
+    Serial.print(countOverflow[i].bin);
+    Serial.print('=');
+    Serial.println(countOverflow[i].count);
+  }
+  Serial.println("END");
+}
@@ -0,0 +1,228 @@
+// Host-side arrival model calibration from the controller's event log.
+//
+// Reads the CSV the controller prints for the 'D' serial command
+// (seq,time_ms,type,arg,value, one record per line, oldest first) and fits,
+// per detector, in a single pass over the file:
+//   - a time-varying Poisson rate: count / observed time per 15-minute bin
+//   - exponential, shifted-exponential and gamma headway distributions, both
+//     over the whole trace and per hour of trace time
+//   - a compound Poisson process: platoon rate and mean platoon size
+// The parameters go to stdout as JSON for the simulator's generators.
+//
+// Build: g++ -O2 -std=c++17 -o arrival_fit tools/arrival_fit.cpp
+// Usage: arrival_fit < dump.csv > arrivals.json
+//
+// The log has no wall clock: time_ms restarts at every LOG_BOOT, so boot
+// segments are laid end to end and bins and hours count trace time, not time
+// of day. Headways never span a reboot.
+
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+const int    LOG_BOOT     = 0;              // must match LogEventType in main.cpp
+const int    LOG_DETECTOR = 2;
+const int    DETECTORS    = 5;              // must match Detector in main.cpp
+const char*  DETECTOR_NAMES[DETECTORS] = {
+  "ns_stop", "ew_stop", "ped", "ns_advance", "ew_advance"
+};
+
+const double RATE_BIN_SEC        = 900.0;   // same 15-minute bins as the volume history
+const double MIN_EXPOSURE_SEC    = 60.0;    // less observed time in a bin: no rate estimate
+const double HOUR_SEC            = 3600.0;
+const double PLATOON_HEADWAY_SEC = 2.5;     // shorter headways join the current platoon
+const double MIN_HEADWAY_SEC     = 0.001;   // log resolution is 1 ms
+const double WRAP_SEC            = 4294967.296;   // uint32_t millis() period
+
+// One-pass sufficient statistics of a headway stream
+struct HeadwayFit {
+  uint64_t n;            // headways
+  double   sumSec;
+  double   sumLogSec;
+  double   minSec;
+};
+
+struct DetectorFit {
+  bool     seenInSegment;
+  double   lastSec;      // trace time of the previous event
+  uint64_t events;
+  uint64_t platoons;
+  HeadwayFit all;
+  std::vector<HeadwayFit> hourly;
+  std::vector<uint32_t>   binCounts;
+};
+
+DetectorFit detectors[DETECTORS];
+std::vector<double> binExposureSec;   // observed time per rate bin, all detectors
+double traceSec = 0;                  // observed time before the current segment
+
+bool   segmentOpen = false;
+double segmentStartMs = 0;            // time_ms where the segment's observation begins
+double segmentLastMs = 0;             // latest time_ms seen, wrap-corrected
+double segmentWrapMs = 0;
+
+void headwayAdd(HeadwayFit& f, double h) {
+  if (f.n == 0 || h < f.minSec) f.minSec = h;
+  f.n++;
+  f.sumSec += h;
+  f.sumLogSec += log(h);
+}
+
+// Spreads the segment's observed interval over the rate bins it covers
+void segmentClose() {
+  if (!segmentOpen) return;
+  double fromSec = traceSec;
+  double toSec = traceSec + (segmentLastMs - segmentStartMs) / 1000.0;
+  while (fromSec < toSec) {
+    size_t bin = (size_t)(fromSec / RATE_BIN_SEC);
+    double binEndSec = (bin + 1) * RATE_BIN_SEC;
+    double spanSec = (toSec < binEndSec ? toSec : binEndSec) - fromSec;
+    if (binExposureSec.size() <= bin) binExposureSec.resize(bin + 1, 0.0);
+    binExposureSec[bin] += spanSec;
+    fromSec += spanSec;
+  }
+  traceSec = toSec;
+  for (int d = 0; d < DETECTORS; d++) detectors[d].seenInSegment = false;
+  segmentOpen = false;
+}
+
+void segmentOpenAt(double timeMs) {
+  segmentOpen = true;
+  segmentStartMs = timeMs;
+  segmentLastMs = timeMs;
+  segmentWrapMs = 0;
+}
+
+void detectorEvent(DetectorFit& f, double nowSec) {
+  f.events++;
+  size_t bin = (size_t)(nowSec / RATE_BIN_SEC);
+  if (f.binCounts.size() <= bin) f.binCounts.resize(bin + 1, 0);
+  f.binCounts[bin]++;
+
+  if (!f.seenInSegment) {
+    f.seenInSegment = true;
+    f.lastSec = nowSec;
+    f.platoons++;
+    return;
+  }
+
+  double h = nowSec - f.lastSec;
+  if (h < MIN_HEADWAY_SEC) h = MIN_HEADWAY_SEC;
+  f.lastSec = nowSec;
+  headwayAdd(f.all, h);
+  size_t hour = (size_t)(nowSec / HOUR_SEC);
+  if (f.hourly.size() <= hour) f.hourly.resize(hour + 1, HeadwayFit{ 0, 0, 0, 0 });
+  headwayAdd(f.hourly[hour], h);
+  if (h > PLATOON_HEADWAY_SEC) f.platoons++;
+}
+
+// Maximum-likelihood parameters from the running sums:
+//   exponential        lambda = n / sum(h)
+//   shifted exponential tau = min(h), lambda = n / (sum(h) - n tau)
+//   gamma              shape from s = ln(mean) - mean(ln h) (Minka's closed form)
+void printHeadwayFit(const HeadwayFit& f) {
+  if (f.n < 2) {
+    printf("{\"n\": %llu}", (unsigned long long)f.n);
+    return;
+  }
+  double mean = f.sumSec / f.n;
+  double shifted = f.sumSec - f.n * f.minSec;
+  double s = log(mean) - f.sumLogSec / f.n;
+  double shape = s > 0 ? (3.0 - s + sqrt((s - 3.0) * (s - 3.0) + 24.0 * s)) / (12.0 * s) : 0.0;
+
+  printf("{\"n\": %llu, ", (unsigned long long)f.n);
+  printf("\"exponential\": {\"lambda\": %.6g}, ", 1.0 / mean);
+  printf("\"shifted_exponential\": {\"tau\": %.6g, \"lambda\": %.6g}, ",
+         f.minSec, shifted > 0 ? f.n / shifted : 0.0);
+  printf("\"gamma\": {\"k\": %.6g, \"theta\": %.6g}}", shape, shape > 0 ? mean / shape : 0.0);
+}
+
+void printDetector(int d) {
+  const DetectorFit& f = detectors[d];
+  printf("    \"%s\": {\n", DETECTOR_NAMES[d]);
+  printf("      \"events\": %llu,\n", (unsigned long long)f.events);
+
+  // Piecewise-constant Poisson rate: the MLE per bin is count / observed time.
+  // Bins observed for less than MIN_EXPOSURE_SEC (a reboot, the end of the
+  // trace) are too noisy to use and print as null.
+  printf("      \"rate_per_hour\": [");
+  for (size_t bin = 0; bin < binExposureSec.size(); bin++) {
+    uint32_t count = bin < f.binCounts.size() ? f.binCounts[bin] : 0;
+    if (bin > 0) printf(", ");
+    if (binExposureSec[bin] >= MIN_EXPOSURE_SEC) {
+      printf("%.6g", count * HOUR_SEC / binExposureSec[bin]);
+    } else {
+      printf("null");
+    }
+  }
+  printf("],\n");
+
+  printf("      \"headway\": ");
+  printHeadwayFit(f.all);
+  printf(",\n");
+
+  printf("      \"headway_hourly\": [");
+  for (size_t hour = 0; hour < f.hourly.size(); hour++) {
+    if (hour > 0) printf(", ");
+    printHeadwayFit(f.hourly[hour]);
+  }
+  printf("],\n");
+
+  // Compound Poisson: platoons arrive at this rate, sizes geometric with this mean
+  printf("      \"compound_poisson\": {\"platoon_rate_per_sec\": %.6g, \"mean_platoon_size\": %.6g}\n",
+         traceSec > 0 ? f.platoons / traceSec : 0.0,
+         f.platoons > 0 ? (double)f.events / f.platoons : 0.0);
+  printf("    }%s\n", d + 1 < DETECTORS ? "," : "");
+}
+
+int main() {
+  char line[128];
+  uint64_t records = 0, skipped = 0;
+
+  while (fgets(line, sizeof(line), stdin)) {
+    unsigned long seq, timeMs;
+    int type, arg;
+    long value;
+    if (sscanf(line, "%lu,%lu,%d,%d,%ld", &seq, &timeMs, &type, &arg, &value) != 5) {
+      skipped++;   // header, END, or other console output
+      continue;
+    }
+    records++;
+
+    if (type == LOG_BOOT) {
+      segmentClose();
+      segmentOpenAt(timeMs);
+      continue;
+    }
+
+    // The oldest pages may have been overwritten, so the trace can start
+    // mid-segment: observation begins at the first record
+    if (!segmentOpen) segmentOpenAt(timeMs);
+    double nowMs = timeMs + segmentWrapMs;
+    if (nowMs < segmentLastMs) {
+      segmentWrapMs += WRAP_SEC * 1000.0;
+      nowMs += WRAP_SEC * 1000.0;
+    }
+    segmentLastMs = nowMs;
+
+    if (type == LOG_DETECTOR && arg >= 0 && arg < DETECTORS) {
+      detectorEvent(detectors[arg], traceSec + (nowMs - segmentStartMs) / 1000.0);
+    }
+  }
+  segmentClose();
+
+  printf("{\n");
+  printf("  \"records\": %llu,\n", (unsigned long long)records);
+  printf("  \"observed_sec\": %.3f,\n", traceSec);
+  printf("  \"rate_bin_sec\": %.0f,\n", RATE_BIN_SEC);
+  printf("  \"platoon_headway_sec\": %.3g,\n", PLATOON_HEADWAY_SEC);
+  printf("  \"detectors\": {\n");
+  for (int d = 0; d < DETECTORS; d++) printDetector(d);
+  printf("  }\n");
+  printf("}\n");
+
+  fprintf(stderr, "arrival_fit: %llu records, %llu other lines skipped\n",
+          (unsigned long long)records, (unsigned long long)skipped);
+  return 0;
+}